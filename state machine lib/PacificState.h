@@ -11,6 +11,9 @@
 #include <thread>
 #include <memory>
 #include <type_traits>
+#include <atomic>
+#include <cstdint>
+#include <exception>
 
 namespace PS {
 
@@ -18,6 +21,12 @@ namespace PS {
         Immediate,
         Queued
     };
+    // how each state looks up its configured triggers
+    enum class PSStorageMode {
+        Auto,   // dense or sparse depending on how many of the triggers a state configures
+        Dense,  // an index entry for every trigger
+        Sparse  // a perfect hash of only the configured triggers
+    };
     template <typename...> class StateMachine;
 
     template <typename TState, typename TTrigger>
@@ -25,8 +34,8 @@ namespace PS {
     {
         static_assert(std::is_enum<TState>::value == true, "state machine state type must be an enum");
         static_assert(std::is_enum<TTrigger>::value == true, "state machine trigger type must be an enum");
-        static_assert(std::is_same_v<std::underlying_type<TState>::type, unsigned int >, "state machine state type must be based on unsigned int");
-        static_assert(std::is_same_v<std::underlying_type<TTrigger>::type, unsigned int >, "state machine trigger type must based mon unsigned int");
+        static_assert(std::is_same_v<typename std::underlying_type<TState>::type, unsigned int >, "state machine state type must be based on unsigned int");
+        static_assert(std::is_same_v<typename std::underlying_type<TTrigger>::type, unsigned int >, "state machine trigger type must based mon unsigned int");
     public:
 
 #pragma region  internal types
@@ -47,6 +56,36 @@ namespace PS {
 
 #pragma endregion
 
+#pragma region LocalQueueFullException
+
+        struct LocalQueueFullException : public std::exception {
+            LocalQueueFullException(TTrigger trigger)
+                :m_trigger(trigger) {}
+            const char* what() const throw () {
+                std::cout << "[STATE MACHINE EXCEPTION] Trigger " << (unsigned int)m_trigger << " fired from a handler but the local queue is full" << std::endl;
+                return "local trigger queue full";
+            }
+        private:
+            TTrigger m_trigger;
+        };
+
+#pragma endregion
+
+#pragma region DeferredQueueFullException
+
+        struct DeferredQueueFullException : public std::exception {
+            DeferredQueueFullException(TTrigger trigger)
+                :m_trigger(trigger) {}
+            const char* what() const throw () {
+                std::cout << "[STATE MACHINE EXCEPTION] Trigger " << (unsigned int)m_trigger << " deferred but the deferred queue is full" << std::endl;
+                return "deferred trigger queue full";
+            }
+        private:
+            TTrigger m_trigger;
+        };
+
+#pragma endregion
+
 #pragma region TransitionInfo
 
         struct TransitionInfo {
@@ -57,24 +96,134 @@ namespace PS {
 
 #pragma endregion
 
+#pragma region ConditionMask
+
+        using ConditionWord = std::uint64_t;
+
+        // declarative guard - passes when every Required bit is set in the machines condition word
+        // and every Forbidden bit is clear. An empty mask always passes.
+        struct ConditionMask {
+            ConditionWord Required = 0;
+            ConditionWord Forbidden = 0;
+
+            bool IsEmpty() const { return (Required | Forbidden) == 0; }
+            bool SatisfiedBy(ConditionWord conditions) const { return (conditions & (Required | Forbidden)) == Required; }
+            // evaluate the mask against the condition words of a whole fleet of machines at once,
+            // kept as a plain loop with no branches so the compiler can vectorize it
+            void SatisfiedBy(const ConditionWord* conditions, size_t count, bool* results) const {
+                const ConditionWord tested = Required | Forbidden;
+                for (size_t i = 0; i < count; i++) {
+                    results[i] = (conditions[i] & tested) == Required;
+                }
+            }
+        };
+
+#pragma endregion
+
+#pragma region LocalTriggerQueue
+
+        // fixed capacity ring buffer of triggers, allocated once up front
+        class LocalTriggerQueue {
+        public:
+            void Reserve(size_t capacity) { m_buffer.resize(capacity); }
+            bool Push(TTrigger trigger) {
+                if (m_count == m_buffer.size()) {
+                    return false;
+                }
+                m_buffer[(m_head + m_count) % m_buffer.size()] = trigger;
+                m_count++;
+                return true;
+            }
+            bool Pop(TTrigger& trigger) {
+                if (m_count == 0) {
+                    return false;
+                }
+                trigger = m_buffer[m_head];
+                m_head = (m_head + 1) % m_buffer.size();
+                m_count--;
+                return true;
+            }
+            size_t Size() const { return m_count; }
+            // drop the most recently pushed triggers until only count are left
+            void Truncate(size_t count) { m_count = std::min(m_count, count); }
+        private:
+            std::vector<TTrigger> m_buffer;
+            size_t m_head = 0;
+            size_t m_count = 0;
+        };
+
+#pragma endregion
+
+#pragma region TriggerSet
+
+        // one bit per trigger
+        class TriggerSet {
+        public:
+            void Resize(size_t numTriggers)               { m_words.assign((numTriggers + 63) / 64, 0); }
+            void Set(TTrigger trigger)                    { m_words[(unsigned int)trigger / 64] |= Bit(trigger); }
+            void Clear(TTrigger trigger)                  { m_words[(unsigned int)trigger / 64] &= ~Bit(trigger); }
+            size_t GetNumWords() const                    { return m_words.size(); }
+            std::uint64_t GetWord(size_t i) const         { return m_words[i]; }
+        private:
+            static std::uint64_t Bit(TTrigger trigger)    { return std::uint64_t(1) << ((unsigned int)trigger % 64); }
+        private:
+            std::vector<std::uint64_t> m_words;
+        };
+
+#pragma endregion
+
 #pragma region StateRepresentation
 
+        // one possible target of an external transition, tried in the order they were configured
+        struct TransitionDecision {
+            TTrigger Trigger;
+            TState Target;
+            ConditionMask Mask;
+            std::function<bool()> GuardClause = nullptr;
+
+            bool Passes(ConditionWord conditions) const { return Mask.SatisfiedBy(conditions) && (GuardClause == nullptr || GuardClause()); }
+            bool IsUnguarded() const { return Mask.IsEmpty() && GuardClause == nullptr; }
+        };
+
+        // everything a state configures for one trigger
+        struct TriggerBehaviour {
+            // the triggers run in the states decision list, set when compiled
+            std::uint32_t FirstDecision = 0;
+            std::uint32_t NumDecisions = 0;
+            std::function<void(TransitionInfo)> InternalAction = nullptr;
+            ConditionMask InternalMask;
+            bool Deferred = false;
+            bool Ignored = false;
+        };
+
         class StateRepresentation {
         public:
             StateRepresentation(TState s) :State(s) {}
             StateRepresentation() {}
             // setters
-            void AddTransition(TTrigger trigger, TState state);
-            void AddInternalTransition(TTrigger trigger, std::function<void(TransitionInfo)> action);
+            void AddTransition(TTrigger trigger, TState state, std::function<bool()> guard = nullptr, ConditionMask mask = ConditionMask());
+            void AddInternalTransition(TTrigger trigger, std::function<void(TransitionInfo)> action, ConditionMask mask = ConditionMask());
             void AddSubState(StateRepresentation* subState) { m_subStates.push_back(subState); }
             void SetSuperState(StateRepresentation* superState) { m_superState = superState; }
             void SetOnEnter(std::function<void(TransitionInfo)> handler);
             void SetOnExit(std::function<void(TransitionInfo)> handler);
-            void AddGuardClause(TTrigger trigger, std::function<bool()> guard);
+            void AddDeferredTrigger(TTrigger trigger)                         { ConfigureBehaviour(trigger).Deferred = true; }
+            void AddIgnoredTrigger(TTrigger trigger)                          { ConfigureBehaviour(trigger).Ignored = true; }
             
-            bool FindTransition(TState& transitionOnOutput, TTrigger trigger);
-            bool FindInternalTransition(std::function<void(TransitionInfo)>& transitionFunction, TTrigger trigger);
+            // the first decision for trigger whose guards pass, on this state or else a super state.
+            // hasTransitions is set if there are any decisions for the trigger at all
+            const TransitionDecision* FindTransition(TTrigger trigger, ConditionWord conditions, bool& hasTransitions) const;
+            const TriggerBehaviour* FindInternalTransition(TTrigger trigger) const;
+            bool IsDeferred(TTrigger trigger) const;
+            bool IsIgnored(TTrigger trigger) const;
+            // what this state itself configures for trigger, ignoring super states. nullptr if nothing
+            const TriggerBehaviour* FindBehaviour(TTrigger trigger) const;
             
+            // lay out the decision list, build the O(1) trigger lookup and the set of triggers with a transition on this state or a super state
+            void Compile(size_t numTriggers, PSStorageMode storage);
+            const TriggerSet& GetPermittedTriggers() const                    { return m_permittedTriggers; }
+            PSStorageMode GetStorage() const                                  { return m_storage; } // Auto until compiled
+            size_t GetIndexSize() const; // bytes used by the compiled trigger lookup
 
             void Enter(TransitionInfo t);
             void Exit(TransitionInfo t);
@@ -82,22 +231,46 @@ namespace PS {
             void GetAllowedTransitions(std::vector<TTrigger>& returnvec) const;
             bool HasEnterHandler() const                                      { return m_onEnter != nullptr; } 
             bool HasExitHandler() const                                       { return m_onExit != nullptr; }
-            const std::vector<std::function<bool()>>& GetGuardClauses() const { return m_guardClauses; }
 
-            void ResizeTransitions(size_t val)                                { m_allowedTransitions.resize(val); }
-            void ResizeInternalTransitions(size_t val)                        { m_internalTransitions.resize(val); }
-            void ResizeGuardClauses(size_t val)                               { m_guardClauses.resize(val); }
+            // queries on this state alone, ignoring super states - used when exporting a definition
+            std::pair<const TransitionDecision*, const TransitionDecision*> GetOwnDecisions(TTrigger trigger) const;
+            bool HasOwnInternalTransition(TTrigger trigger) const             { auto b = FindBehaviour(trigger); return b != nullptr && b->InternalAction != nullptr; }
+            ConditionMask GetOwnInternalMask(TTrigger trigger) const          { auto b = FindBehaviour(trigger); return b != nullptr ? b->InternalMask : ConditionMask(); }
+            bool IsOwnDeferred(TTrigger trigger) const                        { auto b = FindBehaviour(trigger); return b != nullptr && b->Deferred; }
+            bool IsOwnIgnored(TTrigger trigger) const                         { auto b = FindBehaviour(trigger); return b != nullptr && b->Ignored; }
+            const StateRepresentation* GetSuperState() const                  { return m_superState; }
 
         public:
             TState State;
+            // Auto storage picks a dense trigger lookup when at least 1 in DenseFillDivisor triggers are configured
+            static constexpr size_t DenseFillDivisor = 8;
 
         private:
             bool Includes(TState state) const; // is state this state or one of its sub states
             bool IsIncludedIn(TState state) const; // Checks if the state is in the set of this state or a super-state
+            TriggerBehaviour& ConfigureBehaviour(TTrigger trigger);
+            std::uint32_t FindBehaviourIndex(TTrigger trigger) const; // the trigger must be configured
+            void CompileDense(size_t numTriggers);
+            void CompileSparse();
+            static std::uint32_t HashTrigger(std::uint32_t trigger);
         private:
-            std::vector<std::function<bool()>> m_guardClauses;
-            std::vector<TState> m_allowedTransitions;
-            std::vector<std::function<void(TransitionInfo)>> m_internalTransitions;
+            struct HashSlot {
+                std::uint32_t Trigger;
+                std::uint32_t Index;
+            };
+            static constexpr std::uint32_t EmptySlot = 0xffffffff;
+
+            // only the configured triggers are stored, with a (trigger, index) list sorted by trigger to find them while configuring
+            std::vector<TriggerBehaviour> m_behaviours;
+            std::vector<std::pair<std::uint32_t, std::uint32_t>> m_sortedTriggers;
+            // every external transition of the state, sorted by trigger and then in the order configured
+            std::vector<TransitionDecision> m_decisions;
+            // compiled lookup - dense is index + 1 per trigger, sparse is a perfect hash (hash and displace)
+            PSStorageMode m_storage = PSStorageMode::Auto;
+            std::vector<std::uint32_t> m_denseIndex;
+            std::vector<std::uint16_t> m_hashDisplacements;
+            std::vector<HashSlot> m_hashSlots;
+            TriggerSet m_permittedTriggers;
             
             std::function<void(TransitionInfo)> m_onEnter = nullptr;
             std::function<void(TransitionInfo)> m_onExit = nullptr;
@@ -112,48 +285,109 @@ namespace PS {
 
 #pragma region StateConfigObject
 
+        class MachineDefinition;
+
         struct StateConfigObject {
         private:
-            StateMachine* m_stateMachinePtr;
+            MachineDefinition* m_definitionPtr;
         public:
-            StateConfigObject(StateMachine* parent) : m_stateMachinePtr(parent) {}
+            StateConfigObject(MachineDefinition* parent) : m_definitionPtr(parent) {}
             TState StateEnum;
             StateConfigObject Permit(TTrigger trigger, TState state) {
-                auto& staterep = m_stateMachinePtr->m_states[(int)StateEnum];
+                auto& staterep = m_definitionPtr->ConfigureState(StateEnum);
                 staterep.AddTransition(trigger, state);
                 return *this;
             }
             StateConfigObject OnEntry(std::function<void(TransitionInfo)> func) {
-                auto& staterep = m_stateMachinePtr->m_states[(int)StateEnum];
+                auto& staterep = m_definitionPtr->ConfigureState(StateEnum);
                 staterep.SetOnEnter(func);
                 return *this;
             }
             StateConfigObject OnExit(std::function<void(TransitionInfo)> func) {
-                auto& staterep = m_stateMachinePtr->m_states[(int)StateEnum];
+                auto& staterep = m_definitionPtr->ConfigureState(StateEnum);
                 staterep.SetOnExit(func);
                 return *this;
             }
             StateConfigObject SubStateOf(TState superstate) {
-                auto& staterep = m_stateMachinePtr->m_states[(int)StateEnum];
-                staterep.SetSuperState(&m_stateMachinePtr->m_states[(int)superstate]);
-                auto& superstaterep = m_stateMachinePtr->m_states[(int)superstate];
+                auto& staterep = m_definitionPtr->ConfigureState(StateEnum);
+                auto& superstaterep = m_definitionPtr->ConfigureState(superstate);
+                staterep.SetSuperState(&superstaterep);
                 superstaterep.AddSubState(&staterep);
                 return *this;
             }
             StateConfigObject InternalTransition(TTrigger trigger, std::function<void(TransitionInfo)> action) {
-                auto& staterep = m_stateMachinePtr->m_states[(int)StateEnum];
+                auto& staterep = m_definitionPtr->ConfigureState(StateEnum);
                 staterep.AddInternalTransition(trigger, action);
                 return *this;
             }
+            // a trigger can have several guarded targets, they are tried in the order configured and the first
+            // to pass is taken. An unguarded Permit is the fallback and must come last, it asserts otherwise
             StateConfigObject PermitIf(TTrigger trigger, TState state, std::function<bool()> guard) {
-                auto& staterep = m_stateMachinePtr->m_states[(int)StateEnum];
-                staterep.AddTransition(trigger, state);
-                staterep.AddGuardClause(trigger, guard);
+                auto& staterep = m_definitionPtr->ConfigureState(StateEnum);
+                staterep.AddTransition(trigger, state, guard);
+                return *this;
+            }
+            StateConfigObject PermitWhen(TTrigger trigger, TState state, ConditionWord required, ConditionWord forbidden = 0) {
+                auto& staterep = m_definitionPtr->ConfigureState(StateEnum);
+                staterep.AddTransition(trigger, state, nullptr, ConditionMask{ required, forbidden });
+                return *this;
+            }
+            StateConfigObject InternalTransitionWhen(TTrigger trigger, std::function<void(TransitionInfo)> action, ConditionWord required, ConditionWord forbidden = 0) {
+                auto& staterep = m_definitionPtr->ConfigureState(StateEnum);
+                staterep.AddInternalTransition(trigger, action, ConditionMask{ required, forbidden });
+                return *this;
+            }
+            // hold the trigger while in this state and fire it again once a state that permits it is entered
+            StateConfigObject Defer(TTrigger trigger) {
+                auto& staterep = m_definitionPtr->ConfigureState(StateEnum);
+                staterep.AddDeferredTrigger(trigger);
+                return *this;
+            }
+            // silently drop the trigger while in this state instead of throwing TriggerNotFoundException
+            StateConfigObject Ignore(TTrigger trigger) {
+                auto& staterep = m_definitionPtr->ConfigureState(StateEnum);
+                staterep.AddIgnoredTrigger(trigger);
                 return *this;
             }
         };
 #pragma endregion
 
+#pragma region MachineDefinition
+
+        // the configured states and transitions of a machine. A machine reads its definition
+        // through an atomically published pointer so a new one can be built off to the side
+        // and swapped in with PublishDefinition while the machine is running
+        class MachineDefinition {
+        public:
+            MachineDefinition(int numstates, int numtriggers);
+            // states hold pointers to each other so a definition can't be copied or moved
+            MachineDefinition(const MachineDefinition&) = delete;
+            MachineDefinition& operator=(const MachineDefinition&) = delete;
+
+            StateConfigObject ConfigState(TState state);
+            // mutable access for configuration, invalidates anything precomputed from the states
+            StateRepresentation& ConfigureState(TState state)       { m_compiled = false; return m_states[(unsigned int)state]; }
+            StateRepresentation& GetState(TState state)             { return m_states[(unsigned int)state]; }
+            const StateRepresentation& GetState(TState state) const { return m_states[(unsigned int)state]; }
+            int GetNumStates() const                                { return m_numStates; }
+            int GetNumTriggers() const                              { return m_numTriggers; }
+            void EnsureCompiled()                                   { if (!m_compiled) Compile(); }
+            // Auto lets each state choose by how many triggers it configures
+            void SetStorageMode(PSStorageMode mode)                 { m_storageMode = mode; m_compiled = false; }
+
+        private:
+            void Compile();
+
+        private:
+            int m_numStates = 0;
+            int m_numTriggers = 0;
+            bool m_compiled = false;
+            PSStorageMode m_storageMode = PSStorageMode::Auto;
+            std::vector<StateRepresentation> m_states;
+        };
+
+#pragma endregion
+
 #pragma region TriggerEventData
 
         enum class TriggerEventDataTypes { Int, Bool, String, Float, Double, CharPtr };
@@ -175,14 +409,14 @@ namespace PS {
 #pragma endregion
 
     public:
-        StateConfigObject ConfigState(TState state) {
-            assert((int)state != 0); // Enum value zero should not be used, it should represent "null", "nothing", "no state", ect.
-            StateConfigObject config(this);
-            config.StateEnum = state;
-            m_states[(int)state].State = state;
-            return config;
-        }
-        StateMachine(int numstates, int numtriggers, TState initialState);
+        // configures the live definition - do this before the machine starts firing,
+        // use CreateDefinition / PublishDefinition to change it once it is running
+        StateConfigObject ConfigState(TState state) { return m_definition.load()->ConfigState(state); }
+        // localQueueCapacity is how many triggers handlers can fire during a single step. A trigger fired
+        // past that is dropped, the step still completes and LocalQueueFullException is thrown afterwards.
+        // deferredCapacity is how many triggers can be held by Defer at once, its buffers are only
+        // allocated when a trigger is first deferred. Deferring past that throws DeferredQueueFullException
+        StateMachine(int numstates, int numtriggers, TState initialState, size_t localQueueCapacity = 64, size_t deferredCapacity = 64);
         ~StateMachine();
         void RunActive();
         void Fire(TTrigger trigger);
@@ -190,22 +424,109 @@ namespace PS {
         void FireAsync(TTrigger trigger);
         void HandleEventQueue();
         std::vector<TTrigger> GetCurrentAvailableTransitions() const;
+        // call reader with the current definition, which is kept alive until it returns
+        void ReadDefinition(const std::function<void(const MachineDefinition&)>& reader) const;
         inline bool GetIsFiringEvents() const { return m_isFiringEvents; }
+        // condition word tested by PermitWhen / InternalTransitionWhen guards
+        inline void SetConditions(ConditionWord mask)    { m_conditions.fetch_or(mask); }
+        inline void ClearConditions(ConditionWord mask)  { m_conditions.fetch_and(~mask); }
+        inline void ToggleConditions(ConditionWord mask) { m_conditions.fetch_xor(mask); }
+        inline ConditionWord GetConditions() const       { return m_conditions.load(); }
         bool EventQueueEmpty();
+        // an empty definition sized for this machine, to be configured and then published
+        std::unique_ptr<MachineDefinition> CreateDefinition() const;
+        // atomically replace the definition. Dispatches already in flight finish on the old one,
+        // which is reclaimed once no dispatch can still be reading it
+        void PublishDefinition(std::unique_ptr<MachineDefinition> definition);
     private:
         void FireInternalImmediate(TTrigger trigger);
         void FireInternalQueued(TTrigger trigger);
+        // fire trigger, then the triggers its handlers fired, one step at a time without recursing
+        void RunToCompletion(TTrigger trigger);
+        void DrainEventQueue();
+        bool TryPopEvent(TTrigger& trigger);
+
+        // only one thread dispatches on a machine at a time, a handler firing on it is detected by the thread id
+        class DispatchGuard {
+        public:
+            DispatchGuard(StateMachine* sm) : m_sm(sm) {
+                std::thread::id none;
+                m_ownsDispatch = sm->m_dispatchingThread.compare_exchange_strong(none, std::this_thread::get_id());
+            }
+            ~DispatchGuard() {
+                if (m_ownsDispatch) {
+                    m_sm->m_dispatchingThread.store(std::thread::id());
+                }
+            }
+            bool OwnsDispatch() const { return m_ownsDispatch; }
+        private:
+            StateMachine* m_sm;
+            bool m_ownsDispatch;
+        };
+        bool IsDispatchingThread() const { return m_dispatchingThread.load() == std::this_thread::get_id(); }
+
+        // epoch based reclamation of replaced definitions
+        struct RetiredDefinition {
+            unsigned int Epoch;
+            std::unique_ptr<MachineDefinition> Definition;
+        };
+        class EpochGuard {
+        public:
+            EpochGuard(const StateMachine* sm) : m_sm(sm), m_slot(sm->EnterEpoch()) {}
+            ~EpochGuard() { m_sm->ExitEpoch(m_slot); }
+        private:
+            const StateMachine* m_sm;
+            unsigned int m_slot;
+        };
+        unsigned int EnterEpoch() const;
+        void ExitEpoch(unsigned int slot) const;
+        void ReclaimRetiredDefinitions() const;
+
+        void DeferTrigger(TTrigger trigger);
+        void ReleaseDeferredTriggers(const StateRepresentation& newState);
 
     private:
         int m_numStates = 0;
         int m_numTriggers = 0;
         std::atomic_bool m_isFiringEvents = false;
         TState m_currentState;
-        std::vector<StateRepresentation> m_states;
+        std::atomic<ConditionWord> m_conditions = 0;
+        std::atomic<MachineDefinition*> m_definition = nullptr;
         std::queue<TTrigger> m_eventQueue;
         PSFiringMode m_firingMode = PSFiringMode::Queued;
         std::mutex m_eventQueueMutex;
 
+        std::atomic<std::thread::id> m_dispatchingThread;
+        LocalTriggerQueue m_localQueue;
+        bool m_localQueueOverflowed = false;
+        TTrigger m_overflowedTrigger;
+
+        mutable std::atomic<unsigned int> m_epoch = 0;
+        mutable std::atomic<int> m_epochReaders[2];
+        mutable std::atomic_bool m_hasRetiredDefinitions = false;
+        mutable std::mutex m_retiredDefinitionsMutex;
+        mutable std::vector<RetiredDefinition> m_retiredDefinitions;
+
+        // deferred triggers are held in a pool of deferredCapacity slots, allocated when a trigger is first deferred.
+        // each trigger links its own slots in the order it was deferred, with a bit set for each trigger held,
+        // so a release only visits the triggers the new state permits. Released ones run ahead of anything else
+        struct DeferredSlot {
+            std::uint64_t Sequence;
+            std::uint32_t Next;
+        };
+        struct DeferredList {
+            std::uint32_t First;
+            std::uint32_t Last;
+        };
+        static constexpr std::uint32_t NoSlot = 0xffffffff;
+        std::vector<DeferredSlot> m_deferredSlots;
+        std::vector<DeferredList> m_deferredLists;
+        std::uint32_t m_freeDeferredSlot = NoSlot;
+        std::uint64_t m_deferralSequence = 0;
+        TriggerSet m_pendingDeferredTriggers;
+        std::vector<std::pair<std::uint64_t, TTrigger>> m_releasedTriggers; // reserved with the pool, only used while releasing
+        LocalTriggerQueue m_releasedQueue;
+        size_t m_deferredCapacity = 0;
 
         std::atomic_bool m_asyncMode = false;
         std::unique_ptr<std::thread> m_asyncThread;
@@ -213,67 +534,291 @@ namespace PS {
 
 #pragma region StateRepresentation
     template<typename TState, typename TTrigger>
-    inline bool PS::StateMachine<TState, TTrigger>::StateRepresentation::FindInternalTransition(std::function<void(TransitionInfo)>& transitionFunction, TTrigger trigger)
+    inline const typename StateMachine<TState, TTrigger>::TriggerBehaviour* StateMachine<TState, TTrigger>::StateRepresentation::FindInternalTransition(TTrigger trigger) const
     {
-        if (m_internalTransitions[(int)trigger] != nullptr) {
-            transitionFunction = m_internalTransitions[(int)trigger];
-            return true;
+        auto behaviour = FindBehaviour(trigger);
+        if (behaviour != nullptr && behaviour->InternalAction != nullptr) {
+            return behaviour;
         }
         else if (m_superState) {
-            return m_superState->FindInternalTransition(transitionFunction, trigger);
+            return m_superState->FindInternalTransition(trigger);
         }
-        return false;
+        return nullptr;
     }
 
+    template<typename TState, typename TTrigger>
+    inline void StateMachine<TState, TTrigger>::StateRepresentation::AddTransition(TTrigger trigger, TState state, std::function<bool()> guard, ConditionMask mask)
+    {
+        ConfigureBehaviour(trigger);
+        TransitionDecision decision{ trigger, state, mask, guard };
+        // after any decisions already configured for the trigger
+        auto it = std::upper_bound(m_decisions.begin(), m_decisions.end(), trigger,
+            [](TTrigger t, const TransitionDecision& d) { return (std::uint32_t)t < (std::uint32_t)d.Trigger; });
+        if (it != m_decisions.begin() && (it - 1)->Trigger == trigger && (it - 1)->IsUnguarded()) {
+            // an unguarded decision always passes so nothing after it could ever be taken.
+            // Permit again replaces it, a guarded target has to be configured before it
+            if (decision.IsUnguarded()) {
+                *(it - 1) = decision;
+                return;
+            }
+            assert(false && "guarded transition configured after an unguarded Permit for the same trigger");
+            // without asserts keep the unguarded one as the fallback
+            --it;
+        }
+        m_decisions.insert(it, decision);
+    }
 
     template<typename TState, typename TTrigger>
-    inline void StateMachine<TState, TTrigger>::StateRepresentation::AddTransition(TTrigger trigger, TState state)
+    inline void StateMachine<TState, TTrigger>::StateRepresentation::AddInternalTransition(TTrigger trigger, std::function<void(TransitionInfo)> action, ConditionMask mask)
     {
-        m_allowedTransitions[(unsigned int)trigger] = state;
+        auto& behaviour = ConfigureBehaviour(trigger);
+        behaviour.InternalAction = action;
+        behaviour.InternalMask = mask;
+    }
 
+    template<typename TState, typename TTrigger>
+    inline void StateMachine<TState, TTrigger>::StateRepresentation::SetOnEnter(std::function<void(TransitionInfo)> handler)
+    {
+        m_onEnter = handler;
     }
 
     template<typename TState, typename TTrigger>
-    inline void StateMachine<TState, TTrigger>::StateRepresentation::AddInternalTransition(TTrigger trigger, std::function<void(TransitionInfo)> action)
+    inline void StateMachine<TState, TTrigger>::StateRepresentation::SetOnExit(std::function<void(TransitionInfo)> handler)
     {
-        m_internalTransitions[(unsigned int)trigger] = action;
+        m_onExit = handler;
     }
 
+    template<typename TState, typename TTrigger>
+    inline const typename StateMachine<TState, TTrigger>::TransitionDecision* StateMachine<TState, TTrigger>::StateRepresentation::FindTransition(TTrigger trigger, ConditionWord conditions, bool& hasTransitions) const
+    {
+        for (const StateRepresentation* s = this; s != nullptr; s = s->m_superState) {
+            auto decisions = s->GetOwnDecisions(trigger);
+            for (auto d = decisions.first; d != decisions.second; d++) {
+                hasTransitions = true;
+                if (d->Passes(conditions)) {
+                    return d;
+                }
+            }
+        }
+        return nullptr;
+    }
 
+    template<typename TState, typename TTrigger>
+    inline bool StateMachine<TState, TTrigger>::StateRepresentation::IsDeferred(TTrigger trigger) const
+    {
+        return IsOwnDeferred(trigger) || (m_superState != nullptr && m_superState->IsDeferred(trigger));
+    }
 
+    template<typename TState, typename TTrigger>
+    inline bool StateMachine<TState, TTrigger>::StateRepresentation::IsIgnored(TTrigger trigger) const
+    {
+        return IsOwnIgnored(trigger) || (m_superState != nullptr && m_superState->IsIgnored(trigger));
+    }
 
+    template<typename TState, typename TTrigger>
+    inline std::pair<const typename StateMachine<TState, TTrigger>::TransitionDecision*, const typename StateMachine<TState, TTrigger>::TransitionDecision*>
+        StateMachine<TState, TTrigger>::StateRepresentation::GetOwnDecisions(TTrigger trigger) const
+    {
+        if (m_storage != PSStorageMode::Auto) {
+            auto behaviour = FindBehaviour(trigger);
+            if (behaviour == nullptr || behaviour->NumDecisions == 0) {
+                return { nullptr, nullptr };
+            }
+            const TransitionDecision* first = m_decisions.data() + behaviour->FirstDecision;
+            return { first, first + behaviour->NumDecisions };
+        }
+        // not compiled yet
+        auto first = std::lower_bound(m_decisions.begin(), m_decisions.end(), trigger,
+            [](const TransitionDecision& d, TTrigger t) { return (std::uint32_t)d.Trigger < (std::uint32_t)t; });
+        auto last = std::upper_bound(first, m_decisions.end(), trigger,
+            [](TTrigger t, const TransitionDecision& d) { return (std::uint32_t)t < (std::uint32_t)d.Trigger; });
+        if (first == last) {
+            return { nullptr, nullptr };
+        }
+        return { &*first, &*first + (last - first) };
+    }
 
     template<typename TState, typename TTrigger>
-    inline void StateMachine<TState, TTrigger>::StateRepresentation::SetOnEnter(std::function<void(TransitionInfo)> handler)
+    inline const typename StateMachine<TState, TTrigger>::TriggerBehaviour* StateMachine<TState, TTrigger>::StateRepresentation::FindBehaviour(TTrigger trigger) const
     {
-        m_onEnter = handler;
+        const std::uint32_t t = (std::uint32_t)trigger;
+        switch (m_storage) {
+        case PSStorageMode::Dense: {
+            std::uint32_t index = m_denseIndex[t];
+            return index != 0 ? &m_behaviours[index - 1] : nullptr;
+        }
+        case PSStorageMode::Sparse: {
+            // the displacement for the triggers bucket sends it to a slot no other configured trigger uses
+            std::uint32_t hash = HashTrigger(t);
+            std::uint32_t displacement = m_hashDisplacements[(std::uint32_t)(((std::uint64_t)hash * m_hashDisplacements.size()) >> 32)];
+            const HashSlot& slot = m_hashSlots[HashTrigger(t + displacement * 0x9e3779b9u) & (m_hashSlots.size() - 1)];
+            return slot.Trigger == t ? &m_behaviours[slot.Index] : nullptr;
+        }
+        default: {
+            // not compiled yet
+            auto it = std::lower_bound(m_sortedTriggers.begin(), m_sortedTriggers.end(), std::make_pair(t, std::uint32_t(0)));
+            return it != m_sortedTriggers.end() && it->first == t ? &m_behaviours[it->second] : nullptr;
+        }
+        }
     }
 
     template<typename TState, typename TTrigger>
-    inline void StateMachine<TState, TTrigger>::StateRepresentation::SetOnExit(std::function<void(TransitionInfo)> handler)
+    inline typename StateMachine<TState, TTrigger>::TriggerBehaviour& StateMachine<TState, TTrigger>::StateRepresentation::ConfigureBehaviour(TTrigger trigger)
     {
-        m_onExit = handler;
+        const std::uint32_t t = (std::uint32_t)trigger;
+        m_storage = PSStorageMode::Auto;
+        auto it = std::lower_bound(m_sortedTriggers.begin(), m_sortedTriggers.end(), std::make_pair(t, std::uint32_t(0)));
+        if (it != m_sortedTriggers.end() && it->first == t) {
+            return m_behaviours[it->second];
+        }
+        m_sortedTriggers.insert(it, std::make_pair(t, (std::uint32_t)m_behaviours.size()));
+        m_behaviours.emplace_back();
+        return m_behaviours.back();
     }
 
     template<typename TState, typename TTrigger>
-    inline void StateMachine<TState, TTrigger>::StateRepresentation::AddGuardClause(TTrigger trigger, std::function<bool()> guard) 
+    inline std::uint32_t StateMachine<TState, TTrigger>::StateRepresentation::FindBehaviourIndex(TTrigger trigger) const
     {
-        m_guardClauses[(unsigned int)trigger] = guard;
+        auto it = std::lower_bound(m_sortedTriggers.begin(), m_sortedTriggers.end(), std::make_pair((std::uint32_t)trigger, std::uint32_t(0)));
+        return it->second;
     }
 
     template<typename TState, typename TTrigger>
-    inline bool PS::StateMachine<TState, TTrigger>::StateRepresentation::FindTransition(TState& transitionOnOutput, TTrigger trigger)
+    inline void StateMachine<TState, TTrigger>::StateRepresentation::Compile(size_t numTriggers, PSStorageMode storage)
     {
+        if (storage == PSStorageMode::Auto) {
+            storage = m_behaviours.size() * DenseFillDivisor >= numTriggers ? PSStorageMode::Dense : PSStorageMode::Sparse;
+        }
+        if (storage == PSStorageMode::Dense) {
+            CompileDense(numTriggers);
+        }
+        else {
+            CompileSparse();
+        }
+        m_storage = storage;
 
-        if ((int)m_allowedTransitions[(int)trigger]) {
-            transitionOnOutput = m_allowedTransitions[(int)trigger];
-            return true;
+        // the decisions are kept sorted by trigger so each triggers run is already contiguous
+        for (auto& behaviour : m_behaviours) {
+            behaviour.FirstDecision = 0;
+            behaviour.NumDecisions = 0;
         }
-        else if (m_superState) {
-            auto tr = m_superState->FindTransition(transitionOnOutput, trigger);
-            return tr;
+        for (std::uint32_t i = 0; i < m_decisions.size(); i++) {
+            auto& behaviour = m_behaviours[FindBehaviourIndex(m_decisions[i].Trigger)];
+            if (behaviour.NumDecisions == 0) {
+                behaviour.FirstDecision = i;
+            }
+            behaviour.NumDecisions++;
+        }
+
+        m_permittedTriggers.Resize(numTriggers);
+        for (const StateRepresentation* s = this; s != nullptr; s = s->m_superState) {
+            for (auto& decision : s->m_decisions) {
+                m_permittedTriggers.Set(decision.Trigger);
+            }
+            for (auto& entry : s->m_sortedTriggers) {
+                if (s->m_behaviours[entry.second].InternalAction != nullptr) {
+                    m_permittedTriggers.Set((TTrigger)entry.first);
+                }
+            }
+        }
+    }
+
+    template<typename TState, typename TTrigger>
+    inline void StateMachine<TState, TTrigger>::StateRepresentation::CompileDense(size_t numTriggers)
+    {
+        m_hashDisplacements.clear();
+        m_hashSlots.clear();
+        m_denseIndex.assign(numTriggers, 0);
+        for (auto& entry : m_sortedTriggers) {
+            m_denseIndex[entry.first] = entry.second + 1;
         }
-        return false;
+    }
+
+    template<typename TState, typename TTrigger>
+    inline void StateMachine<TState, TTrigger>::StateRepresentation::CompileSparse()
+    {
+        m_denseIndex.clear();
+        const size_t numConfigured = m_sortedTriggers.size();
+        // about 4 triggers per bucket, and at least twice as many slots as triggers
+        size_t numBuckets = 1;
+        while (numBuckets * 4 < numConfigured) {
+            numBuckets *= 2;
+        }
+        size_t numSlots = 1;
+        while (numSlots < numConfigured * 2) {
+            numSlots *= 2;
+        }
+
+        while (true) {
+            std::vector<std::vector<std::uint32_t>> buckets(numBuckets);
+            for (auto& entry : m_sortedTriggers) {
+                buckets[(std::uint32_t)(((std::uint64_t)HashTrigger(entry.first) * numBuckets) >> 32)].push_back(entry.first);
+            }
+            // place the fullest buckets first, while there is the most room
+            std::vector<std::uint32_t> order(numBuckets);
+            for (std::uint32_t i = 0; i < numBuckets; i++) {
+                order[i] = i;
+            }
+            std::stable_sort(order.begin(), order.end(), [&buckets](std::uint32_t a, std::uint32_t b) { return buckets[a].size() > buckets[b].size(); });
+
+            m_hashDisplacements.assign(numBuckets, 0);
+            m_hashSlots.assign(numSlots, HashSlot{ EmptySlot, 0 });
+            bool placedAll = true;
+            for (auto b : order) {
+                auto& bucket = buckets[b];
+                if (bucket.empty()) {
+                    break;
+                }
+                // find a displacement that puts every trigger in the bucket in a free slot of its own
+                bool placed = false;
+                for (std::uint32_t displacement = 0; displacement <= 0xffff && !placed; displacement++) {
+                    placed = true;
+                    for (size_t i = 0; i < bucket.size() && placed; i++) {
+                        auto slot = HashTrigger(bucket[i] + displacement * 0x9e3779b9u) & (numSlots - 1);
+                        placed = m_hashSlots[slot].Trigger == EmptySlot;
+                        for (size_t j = 0; j < i && placed; j++) {
+                            placed = slot != (HashTrigger(bucket[j] + displacement * 0x9e3779b9u) & (numSlots - 1));
+                        }
+                    }
+                    if (placed) {
+                        m_hashDisplacements[b] = (std::uint16_t)displacement;
+                        for (auto t : bucket) {
+                            auto& slot = m_hashSlots[HashTrigger(t + displacement * 0x9e3779b9u) & (numSlots - 1)];
+                            auto it = std::lower_bound(m_sortedTriggers.begin(), m_sortedTriggers.end(), std::make_pair(t, std::uint32_t(0)));
+                            slot = HashSlot{ t, it->second };
+                        }
+                    }
+                }
+                if (!placed) {
+                    placedAll = false;
+                    break;
+                }
+            }
+            if (placedAll) {
+                return;
+            }
+            numSlots *= 2;
+        }
+    }
+
+    template<typename TState, typename TTrigger>
+    inline std::uint32_t StateMachine<TState, TTrigger>::StateRepresentation::HashTrigger(std::uint32_t trigger)
+    {
+        // murmur3 finalizer
+        trigger ^= trigger >> 16;
+        trigger *= 0x85ebca6bu;
+        trigger ^= trigger >> 13;
+        trigger *= 0xc2b2ae35u;
+        trigger ^= trigger >> 16;
+        return trigger;
+    }
+
+    template<typename TState, typename TTrigger>
+    inline size_t StateMachine<TState, TTrigger>::StateRepresentation::GetIndexSize() const
+    {
+        return m_denseIndex.size() * sizeof(std::uint32_t)
+            + m_hashDisplacements.size() * sizeof(std::uint16_t)
+            + m_hashSlots.size() * sizeof(HashSlot);
     }
 
     template<typename TState, typename TTrigger>
@@ -325,14 +870,14 @@ namespace PS {
     inline void StateMachine<TState, TTrigger>::StateRepresentation::GetAllowedTransitions(std::vector<TTrigger>& returnvec) const
     {
 
-        for (int i = 0; i < m_allowedTransitions.size(); i++) {
-            if ((int)m_allowedTransitions[i] != 0) {
-                returnvec.push_back((TTrigger)i);
+        for (size_t i = 0; i < m_decisions.size(); i++) {
+            if (i == 0 || m_decisions[i].Trigger != m_decisions[i - 1].Trigger) {
+                returnvec.push_back(m_decisions[i].Trigger);
             }
         }
-        for (int i = 0; i < m_internalTransitions.size(); i++) {
-            if (m_internalTransitions[i] != nullptr) {
-                returnvec.push_back((TTrigger)i);
+        for (auto& entry : m_sortedTriggers) {
+            if (m_behaviours[entry.second].InternalAction != nullptr) {
+                returnvec.push_back((TTrigger)entry.first);
             }
         }
     }
@@ -352,8 +897,25 @@ namespace PS {
     template<typename TState, typename TTrigger>
     inline void StateMachine<TState, TTrigger>::Fire(TTrigger trigger)
     {
+        // fired from a handler, run it once the current step has completed.
+        // throwing from here would fault the machine if the handler is an entry or exit action,
+        // so an overflow is only recorded and reported once the step is done
+        if (IsDispatchingThread()) {
+            if (!m_localQueue.Push(trigger) && !m_localQueueOverflowed) {
+                m_localQueueOverflowed = true;
+                m_overflowedTrigger = trigger;
+            }
+            return;
+        }
         if (m_firingMode == PSFiringMode::Immediate) {
-            FireInternalImmediate(trigger);
+            DispatchGuard dispatch(this);
+            if (!dispatch.OwnsDispatch()) {
+                // another thread is dispatching, it will pick this up from the queue
+                FireInternalQueued(trigger);
+                return;
+            }
+            RunToCompletion(trigger);
+            DrainEventQueue();
         }
         else if (m_firingMode == PSFiringMode::Queued) {
             FireInternalQueued(trigger);
@@ -375,8 +937,12 @@ namespace PS {
     template<typename TState, typename TTrigger>
     inline void PS::StateMachine<TState, TTrigger>::FireInternalImmediate(TTrigger trigger)
     {
-        auto& currentState = m_states[(unsigned int)m_currentState];
-        const auto& guardClauses = currentState.GetGuardClauses();
+        // the whole dispatch runs on the definition loaded here, even if a new one is published meanwhile
+        EpochGuard epochGuard(this);
+        auto& definition = *m_definition.load();
+        definition.EnsureCompiled();
+        auto& currentState = definition.GetState(m_currentState);
+        const ConditionWord conditions = m_conditions.load();
         /*
             if there is an internal transition set up this will override the same trigger being set as an external transition
 
@@ -384,23 +950,32 @@ namespace PS {
         */
 
 
-        TState nextstateEnum;
-
         // see if there is any external transitions allowed.
         // if not check for any internal transtitions
-        if (!currentState.FindTransition(nextstateEnum, trigger)) {
+        bool hasTransitions = false;
+        const TransitionDecision* decision = currentState.FindTransition(trigger, conditions, hasTransitions);
+        if (decision == nullptr) {
+            if (hasTransitions) {
+                std::cout << "guard clause failed " << std::endl;
+                return;
+            }
             TransitionInfo t;
             t.From = m_currentState;
             t.To = m_currentState;
-            std::function<void(TransitionInfo)> internalT = nullptr;
-            if (currentState.FindInternalTransition(internalT, trigger)) {
-                if (guardClauses[(int)trigger] != nullptr) {
-                    if (!guardClauses[(int)trigger]()) {
-                        std::cout << "guard clause failed " << std::endl;
-                        return;
-                    }
+            const TriggerBehaviour* internalT = currentState.FindInternalTransition(trigger);
+            if (internalT != nullptr) {
+                if (!internalT->InternalMask.SatisfiedBy(conditions)) {
+                    std::cout << "guard condition failed " << std::endl;
+                    return;
                 }
-                internalT(t);
+                internalT->InternalAction(t);
+                return;
+            }
+            else if (currentState.IsIgnored(trigger)) {
+                return;
+            }
+            else if (currentState.IsDeferred(trigger)) {
+                DeferTrigger(trigger);
                 return;
             }
             else {
@@ -411,13 +986,8 @@ namespace PS {
 
         }
         // if this point has been reached, there's an external transition
-        // for this trigger. Do entry and exit actions
-        if (guardClauses[(int)trigger] != nullptr) {
-            if (!guardClauses[(int)trigger]()) {
-                std::cout << "guard clause failed " << std::endl;
-                return;
-            }
-        }
+        // for this trigger whose guards passed. Do entry and exit actions
+        TState nextstateEnum = decision->Target;
         TransitionInfo t;
         std::exception innerException;
         t.From = m_currentState;
@@ -432,7 +1002,7 @@ namespace PS {
                 innerException = e;
             }
         }
-        auto& nextstate = m_states[(unsigned int)nextstateEnum];
+        auto& nextstate = definition.GetState(nextstateEnum);
         bool onEnterException = false;
         if (nextstate.HasEnterHandler()) {
             try {
@@ -458,54 +1028,160 @@ namespace PS {
             throw innerException;
             
         }
+        ReleaseDeferredTriggers(nextstate);
+    }
+
+    template<typename TState, typename TTrigger>
+    inline void StateMachine<TState, TTrigger>::DeferTrigger(TTrigger trigger)
+    {
+        if (m_deferredSlots.empty() && m_deferredCapacity != 0) {
+            // first trigger deferred on this machine, every slot starts on the free list
+            m_deferredSlots.resize(m_deferredCapacity);
+            for (size_t i = 0; i < m_deferredCapacity; i++) {
+                m_deferredSlots[i].Next = i + 1 < m_deferredCapacity ? (std::uint32_t)(i + 1) : NoSlot;
+            }
+            m_freeDeferredSlot = 0;
+            m_deferredLists.assign(m_numTriggers, DeferredList{ NoSlot, NoSlot });
+            m_releasedTriggers.reserve(m_deferredCapacity);
+            m_releasedQueue.Reserve(m_deferredCapacity);
+        }
+        if (m_freeDeferredSlot == NoSlot) {
+            throw DeferredQueueFullException(trigger);
+        }
+        std::uint32_t slot = m_freeDeferredSlot;
+        m_freeDeferredSlot = m_deferredSlots[slot].Next;
+        m_deferredSlots[slot] = DeferredSlot{ m_deferralSequence++, NoSlot };
+        DeferredList& list = m_deferredLists[(unsigned int)trigger];
+        if (list.First == NoSlot) {
+            list.First = slot;
+        }
+        else {
+            m_deferredSlots[list.Last].Next = slot;
+        }
+        list.Last = slot;
+        m_pendingDeferredTriggers.Set(trigger);
+    }
+
+    template<typename TState, typename TTrigger>
+    inline void StateMachine<TState, TTrigger>::ReleaseDeferredTriggers(const StateRepresentation& newState)
+    {
+        // only the deferred triggers the new state permits are looked at, a word at a time
+        const TriggerSet& permitted = newState.GetPermittedTriggers();
+        for (size_t i = 0; i < m_pendingDeferredTriggers.GetNumWords(); i++) {
+            std::uint64_t released = m_pendingDeferredTriggers.GetWord(i) & permitted.GetWord(i);
+            for (unsigned int bit = 0; released != 0; bit++, released >>= 1) {
+                if ((released & 1) == 0) {
+                    continue;
+                }
+                TTrigger trigger = (TTrigger)(i * 64 + bit);
+                DeferredList& list = m_deferredLists[(unsigned int)trigger];
+                // collect the triggers slots, handing each back to the free list
+                for (std::uint32_t slot = list.First; slot != NoSlot;) {
+                    DeferredSlot& deferred = m_deferredSlots[slot];
+                    std::uint32_t next = deferred.Next;
+                    m_releasedTriggers.push_back({ deferred.Sequence, trigger });
+                    deferred.Next = m_freeDeferredSlot;
+                    m_freeDeferredSlot = slot;
+                    slot = next;
+                }
+                list = DeferredList{ NoSlot, NoSlot };
+                m_pendingDeferredTriggers.Clear(trigger);
+            }
+        }
+        if (m_releasedTriggers.empty()) {
+            return;
+        }
+        // fire them again in the order they were originally fired. Released triggers run before anything
+        // new can be deferred, so with the ones still held they never outnumber the pool and the push can't fail
+        std::sort(m_releasedTriggers.begin(), m_releasedTriggers.end());
+        for (auto& releasedTrigger : m_releasedTriggers) {
+            m_releasedQueue.Push(releasedTrigger.second);
+        }
+        m_releasedTriggers.clear();
     }
 
     template<typename TState, typename TTrigger>
     inline void PS::StateMachine<TState, TTrigger>::FireInternalQueued(TTrigger trigger)
     {
         // will queue the trigger and then process triggers on the queue until it is empty.
-        // if another thread calls this method while the 
-        static bool s_isQueueBeingHandled = false;
-        static std::mutex s_isQueueBeingHandledMutex;
-
+        // if another thread is already dispatching on this machine it is left to that thread
         {
             std::lock_guard<std::mutex> lg(m_eventQueueMutex);
             m_eventQueue.push(trigger);
         }
-        {
-            std::lock_guard<std::mutex> lg(s_isQueueBeingHandledMutex);
-            if (s_isQueueBeingHandled) {
-                return;
+        while (true) {
+            {
+                DispatchGuard dispatch(this);
+                if (!dispatch.OwnsDispatch()) {
+                    return;
+                }
+                try {
+                    DrainEventQueue();
+                }
+                catch (std::exception& e) {
+                    std::string txt = e.what();
+                    std::cout << txt << std::endl;
+                    throw;
+                }
             }
-            else {
-                s_isQueueBeingHandled = true;
+            // something may have been queued after the queue was drained but before dispatch was released
+            if (EventQueueEmpty()) {
+                return;
             }
         }
+    }
 
-        try {
-            while (!EventQueueEmpty()) {
-                TTrigger trigger = m_eventQueue.front();
-                m_eventQueue.pop();
-                FireInternalImmediate(trigger);
+    template<typename TState, typename TTrigger>
+    inline void StateMachine<TState, TTrigger>::RunToCompletion(TTrigger trigger)
+    {
+        // a failing step doesn't stop the triggers fired by the steps before it,
+        // the first failure is rethrown once they have all run. Deferred triggers released by a step
+        // are older than anything its handlers fired, so they run first
+        std::exception_ptr firstFailure = nullptr;
+        TTrigger next = trigger;
+        do {
+            size_t queuedBefore = m_localQueue.Size();
+            try {
+                FireInternalImmediate(next);
             }
+            catch (...) {
+                // only the triggers this step fired are dropped with it
+                m_localQueue.Truncate(queuedBefore);
+                if (firstFailure == nullptr) {
+                    firstFailure = std::current_exception();
+                }
+            }
+            if (m_localQueueOverflowed) {
+                m_localQueueOverflowed = false;
+                if (firstFailure == nullptr) {
+                    firstFailure = std::make_exception_ptr(LocalQueueFullException(m_overflowedTrigger));
+                }
+            }
+        } while (m_releasedQueue.Pop(next) || m_localQueue.Pop(next));
+        if (firstFailure != nullptr) {
+            std::rethrow_exception(firstFailure);
         }
-        catch (TriggerNotFoundException e) {
-            std::string txt = e.what();
-            std::cout << txt << std::endl;
-            s_isQueueBeingHandled = false;
-            throw e;
-        }
-        catch (std::exception& e) {
-            std::string txt = e.what();
-            std::cout << txt << std::endl;
-            s_isQueueBeingHandled = false;
-            throw e;
+    }
+
+    template<typename TState, typename TTrigger>
+    inline void StateMachine<TState, TTrigger>::DrainEventQueue()
+    {
+        TTrigger trigger;
+        while (TryPopEvent(trigger)) {
+            RunToCompletion(trigger);
         }
+    }
 
-        {
-            std::lock_guard<std::mutex> lg(s_isQueueBeingHandledMutex);
-            s_isQueueBeingHandled = false;
+    template<typename TState, typename TTrigger>
+    inline bool StateMachine<TState, TTrigger>::TryPopEvent(TTrigger& trigger)
+    {
+        std::lock_guard<std::mutex> lg(m_eventQueueMutex);
+        if (m_eventQueue.empty()) {
+            return false;
         }
+        trigger = m_eventQueue.front();
+        m_eventQueue.pop();
+        return true;
     }
 
     template<typename TState, typename TTrigger>
@@ -534,33 +1210,38 @@ namespace PS {
     template<typename TState, typename TTrigger>
     inline void StateMachine<TState, TTrigger>::HandleEventQueue()
     {
-
-        while (!EventQueueEmpty()) {
-            TTrigger trigger = m_eventQueue.front();
-            m_eventQueue.pop();
+        DispatchGuard dispatch(this);
+        if (!dispatch.OwnsDispatch()) {
+            return;
+        }
+        TTrigger trigger;
+        while (TryPopEvent(trigger)) {
             try {
-                FireInternalImmediate(trigger);
+                RunToCompletion(trigger);
             }
             catch (std::exception& e) {
                 std::cout << e.what() << std::endl;
             }
         }
-        if (m_isFiringEvents)
-            m_isFiringEvents = false;
+        {
+            // only clear it if FireAsync hasn't queued something since the queue was drained
+            std::lock_guard<std::mutex> lg(m_eventQueueMutex);
+            if (m_eventQueue.empty())
+                m_isFiringEvents = false;
+        }
     }
 
 
 
     template<typename TState, typename TTrigger>
-    inline StateMachine<TState, TTrigger>::StateMachine(int numstates, int numtriggers, TState initialState)
-        : m_currentState(initialState), m_numStates(numstates), m_numTriggers(numtriggers) {
-        m_states.resize(numstates);
-        for (int i = 0; i < numstates; i++) {
-            auto& state = m_states[i];
-            state.ResizeTransitions(numtriggers);
-            state.ResizeInternalTransitions(numtriggers);
-            state.ResizeGuardClauses(numtriggers);
-        }
+    inline StateMachine<TState, TTrigger>::StateMachine(int numstates, int numtriggers, TState initialState, size_t localQueueCapacity, size_t deferredCapacity)
+        : m_currentState(initialState), m_numStates(numstates), m_numTriggers(numtriggers), m_deferredCapacity(deferredCapacity) {
+        m_dispatchingThread = std::thread::id();
+        m_localQueue.Reserve(localQueueCapacity);
+        m_epochReaders[0] = 0;
+        m_epochReaders[1] = 0;
+        m_definition = new MachineDefinition(numstates, numtriggers);
+        m_pendingDeferredTriggers.Resize(numtriggers);
     }
 
     template<typename TState, typename TTrigger>
@@ -570,13 +1251,17 @@ namespace PS {
             m_asyncMode = false;
             m_asyncThread->join();
         }
+        // nothing can be dispatching now so every definition can go
+        m_retiredDefinitions.clear();
+        delete m_definition.load();
     }
 
     template<typename TState, typename TTrigger>
     inline std::vector<TTrigger> PS::StateMachine<TState, TTrigger>::GetCurrentAvailableTransitions() const
     {
         std::vector<TTrigger> returnvec;
-        m_states[(int)m_currentState].GetAllowedTransitions(returnvec);
+        EpochGuard epochGuard(this);
+        m_definition.load()->GetState(m_currentState).GetAllowedTransitions(returnvec);
         return returnvec;
     }
 
@@ -592,6 +1277,113 @@ namespace PS {
         return returnval;
     }
 
+    template<typename TState, typename TTrigger>
+    inline std::unique_ptr<typename StateMachine<TState, TTrigger>::MachineDefinition> StateMachine<TState, TTrigger>::CreateDefinition() const
+    {
+        return std::make_unique<MachineDefinition>(m_numStates, m_numTriggers);
+    }
+
+    template<typename TState, typename TTrigger>
+    inline void StateMachine<TState, TTrigger>::PublishDefinition(std::unique_ptr<MachineDefinition> definition)
+    {
+        // state and trigger enums index straight into the definition so it must be the same shape
+        assert(definition->GetNumStates() == m_numStates && definition->GetNumTriggers() == m_numTriggers);
+        definition->EnsureCompiled();
+        {
+            std::lock_guard<std::mutex> lg(m_retiredDefinitionsMutex);
+            MachineDefinition* old = m_definition.exchange(definition.release());
+            // any dispatch that could have loaded the old pointer entered in this epoch or an earlier one
+            m_retiredDefinitions.push_back(RetiredDefinition{ m_epoch.load(), std::unique_ptr<MachineDefinition>(old) });
+            m_hasRetiredDefinitions = true;
+        }
+        ReclaimRetiredDefinitions();
+    }
+
+    template<typename TState, typename TTrigger>
+    inline void StateMachine<TState, TTrigger>::ReadDefinition(const std::function<void(const MachineDefinition&)>& reader) const
+    {
+        EpochGuard epochGuard(this);
+        reader(*m_definition.load());
+    }
+
+    template<typename TState, typename TTrigger>
+    inline unsigned int StateMachine<TState, TTrigger>::EnterEpoch() const
+    {
+        while (true) {
+            unsigned int epoch = m_epoch.load();
+            m_epochReaders[epoch & 1].fetch_add(1);
+            // the epoch may have moved on between reading it and registering, if so register again
+            if (m_epoch.load() == epoch) {
+                return epoch & 1;
+            }
+            m_epochReaders[epoch & 1].fetch_sub(1);
+        }
+    }
+
+    template<typename TState, typename TTrigger>
+    inline void StateMachine<TState, TTrigger>::ExitEpoch(unsigned int slot) const
+    {
+        m_epochReaders[slot].fetch_sub(1);
+        if (m_hasRetiredDefinitions) {
+            ReclaimRetiredDefinitions();
+        }
+    }
+
+    template<typename TState, typename TTrigger>
+    inline void StateMachine<TState, TTrigger>::ReclaimRetiredDefinitions() const
+    {
+        // never block a dispatch on reclamation, whoever holds the lock will do it
+        std::unique_lock<std::mutex> lock(m_retiredDefinitionsMutex, std::try_to_lock);
+        if (!lock.owns_lock()) {
+            return;
+        }
+        // the epoch can only advance once the readers of the epoch before it have all left,
+        // so when it has advanced twice past a definitions retirement nobody can still be using it
+        for (int i = 0; i < 2; i++) {
+            unsigned int epoch = m_epoch.load();
+            if (m_epochReaders[(epoch + 1) & 1].load() != 0) {
+                break;
+            }
+            m_epoch.store(epoch + 1);
+        }
+        unsigned int epoch = m_epoch.load();
+        m_retiredDefinitions.erase(
+            std::remove_if(m_retiredDefinitions.begin(), m_retiredDefinitions.end(),
+                [epoch](const RetiredDefinition& r) { return epoch - r.Epoch >= 2; }),
+            m_retiredDefinitions.end());
+        m_hasRetiredDefinitions = !m_retiredDefinitions.empty();
+    }
+
+#pragma endregion
+
+#pragma region MachineDefinition
+
+    template<typename TState, typename TTrigger>
+    inline StateMachine<TState, TTrigger>::MachineDefinition::MachineDefinition(int numstates, int numtriggers)
+        : m_numStates(numstates), m_numTriggers(numtriggers) {
+        // states only store the triggers they configure, nothing is sized by the number of triggers until compiled
+        m_states.resize(numstates);
+    }
+
+    template<typename TState, typename TTrigger>
+    inline void StateMachine<TState, TTrigger>::MachineDefinition::Compile()
+    {
+        for (auto& state : m_states) {
+            state.Compile(m_numTriggers, m_storageMode);
+        }
+        m_compiled = true;
+    }
+
+    template<typename TState, typename TTrigger>
+    inline typename StateMachine<TState, TTrigger>::StateConfigObject StateMachine<TState, TTrigger>::MachineDefinition::ConfigState(TState state)
+    {
+        assert((int)state != 0); // Enum value zero should not be used, it should represent "null", "nothing", "no state", ect.
+        StateConfigObject config(this);
+        config.StateEnum = state;
+        ConfigureState(state).State = state;
+        return config;
+    }
+
 #pragma endregion
 
 
@@ -0,0 +1,475 @@
+#pragma once
+#include "PacificState.h"
+#include <ostream>
+#include <string>
+#include <vector>
+#include <cctype>
+
+/*
+    Exports a configured state machine as a plain C dispatcher for embedded targets.
+
+    The generated file is single header style: include it wherever the machine is used and
+    define <PREFIX>_DISPATCH_IMPLEMENTATION in exactly one translation unit. Transitions and
+    state hierarchies are resolved at export time into const tables, so the target does no
+    configuration at start up and a machine costs only its current state and condition word
+    in RAM.
+
+    std::function handlers can't be exported, so for every OnEntry, OnExit, InternalTransition
+    and PermitIf guard the generated file declares a hook function for the target to implement.
+    PermitWhen condition masks are exported as they are.
+*/
+
+namespace PS {
+
+    struct PSExportOptions {
+        std::string Prefix = "ps";
+        std::vector<std::string> StateNames;   // indexed by state enum value, "State<n>" is used if missing
+        std::vector<std::string> TriggerNames; // indexed by trigger enum value, "Trigger<n>" is used if missing
+    };
+
+    template <typename TState, typename TTrigger>
+    class CExporter
+    {
+    public:
+        using Machine = StateMachine<TState, TTrigger>;
+        using MachineDefinition = typename Machine::MachineDefinition;
+        using StateRepresentation = typename Machine::StateRepresentation;
+        using ConditionMask = typename Machine::ConditionMask;
+        using TransitionDecision = typename Machine::TransitionDecision;
+
+        CExporter(const MachineDefinition& definition, const PSExportOptions& options)
+            :m_definition(definition), m_options(options) {}
+        void Export(std::ostream& out);
+
+    private:
+        enum class ResolvedKind { None, External, Internal, Ignored, Deferred };
+
+        struct ResolvedDecision {
+            unsigned int Target = 0;
+            std::string GuardHook; // empty if there is no guard function
+            ConditionMask Mask;
+        };
+
+        // what a trigger does in a state once the state hierarchy has been taken into account
+        struct ResolvedTrigger {
+            ResolvedKind Kind = ResolvedKind::None;
+            std::vector<ResolvedDecision> Decisions; // external transitions, in the order they are tried
+            unsigned int DefinedOn = 0;              // internal transitions
+            ConditionMask Mask;
+        };
+
+        ResolvedTrigger Resolve(unsigned int state, unsigned int trigger) const;
+        std::vector<unsigned int> GetChain(unsigned int state) const; // root super state first, state itself last
+        unsigned int IndexOf(const StateRepresentation* state) const { return (unsigned int)(state - &m_definition.GetState((TState)0)); }
+
+        std::string StateName(unsigned int state) const;
+        std::string TriggerName(unsigned int trigger) const;
+        std::string StateEnum(unsigned int state) const             { return Upper(m_options.Prefix) + "_STATE_" + Upper(StateName(state)); }
+        std::string TriggerEnum(unsigned int trigger) const         { return Upper(m_options.Prefix) + "_TRIGGER_" + Upper(TriggerName(trigger)); }
+        std::string Hook(const std::string& kind, unsigned int state) const { return m_options.Prefix + "_" + kind + "_" + StateName(state); }
+        std::string Hook(const std::string& kind, unsigned int state, unsigned int trigger) const { return Hook(kind, state) + "_" + TriggerName(trigger); }
+        std::string GuardHook(unsigned int state, unsigned int trigger, size_t decision) const;
+        std::string GuardCondition(const ResolvedDecision& decision) const;
+        static std::string Sanitize(const std::string& name);
+        static std::string Upper(std::string name);
+        static std::string Hex(std::uint64_t value);
+
+        void WriteDeclarations(std::ostream& out);
+        void WriteTables(std::ostream& out);
+        void WriteDispatcher(std::ostream& out);
+
+    private:
+        const MachineDefinition& m_definition;
+        const PSExportOptions& m_options;
+        std::vector<std::vector<ResolvedTrigger>> m_resolved;
+        std::vector<std::vector<unsigned int>> m_chains;
+        std::string m_machineType;
+        std::string m_stateType;
+        std::string m_triggerType;
+        std::string m_resultType;
+    };
+
+    // write the current definition of machine to out as a standalone C source file
+    template <typename TState, typename TTrigger>
+    void ExportC(const StateMachine<TState, TTrigger>& machine, std::ostream& out, const PSExportOptions& options = PSExportOptions())
+    {
+        machine.ReadDefinition([&](const typename StateMachine<TState, TTrigger>::MachineDefinition& definition) {
+            CExporter<TState, TTrigger> exporter(definition, options);
+            exporter.Export(out);
+        });
+    }
+
+#pragma region CExporter
+
+    template<typename TState, typename TTrigger>
+    inline void CExporter<TState, TTrigger>::Export(std::ostream& out)
+    {
+        const unsigned int numStates = m_definition.GetNumStates();
+        const unsigned int numTriggers = m_definition.GetNumTriggers();
+        m_resolved.assign(numStates, std::vector<ResolvedTrigger>(numTriggers));
+        m_chains.assign(numStates, std::vector<unsigned int>());
+        for (unsigned int s = 1; s < numStates; s++) {
+            m_chains[s] = GetChain(s);
+            for (unsigned int t = 1; t < numTriggers; t++) {
+                m_resolved[s][t] = Resolve(s, t);
+            }
+        }
+        m_machineType = m_options.Prefix + "_machine_t";
+        m_stateType = m_options.Prefix + "_state_t";
+        m_triggerType = m_options.Prefix + "_trigger_t";
+        m_resultType = m_options.Prefix + "_result_t";
+
+        const std::string guard = Upper(m_options.Prefix) + "_DISPATCH_H";
+        out << "/* generated by PacificState - do not edit, export the C++ configuration again instead */\n";
+        out << "#ifndef " << guard << "\n#define " << guard << "\n\n";
+        out << "#include <stdint.h>\n\n";
+        out << "#ifdef __cplusplus\nextern \"C\" {\n#endif\n\n";
+        WriteDeclarations(out);
+        out << "#ifdef __cplusplus\n}\n#endif\n\n";
+        out << "#endif /* " << guard << " */\n\n";
+        out << "#ifdef " << Upper(m_options.Prefix) << "_DISPATCH_IMPLEMENTATION\n\n";
+        WriteTables(out);
+        WriteDispatcher(out);
+        out << "#endif /* " << Upper(m_options.Prefix) << "_DISPATCH_IMPLEMENTATION */\n";
+    }
+
+    template<typename TState, typename TTrigger>
+    inline typename CExporter<TState, TTrigger>::ResolvedTrigger CExporter<TState, TTrigger>::Resolve(unsigned int state, unsigned int trigger) const
+    {
+        // same precedence as the C++ dispatcher: external transitions anywhere up the hierarchy,
+        // then internal transitions, then ignored and finally deferred triggers
+        ResolvedTrigger r;
+        const TTrigger t = (TTrigger)trigger;
+        const StateRepresentation* first = &m_definition.GetState((TState)state);
+        for (auto s = first; s != nullptr; s = s->GetSuperState()) {
+            auto decisions = s->GetOwnDecisions(t);
+            for (auto d = decisions.first; d != decisions.second; d++) {
+                ResolvedDecision decision;
+                decision.Target = (unsigned int)d->Target;
+                decision.Mask = d->Mask;
+                if (d->GuardClause != nullptr) {
+                    decision.GuardHook = GuardHook(IndexOf(s), trigger, d - decisions.first);
+                }
+                r.Decisions.push_back(decision);
+                r.Kind = ResolvedKind::External;
+            }
+        }
+        if (r.Kind != ResolvedKind::None) {
+            return r;
+        }
+        for (auto s = first; s != nullptr; s = s->GetSuperState()) {
+            if (s->HasOwnInternalTransition(t)) {
+                r.Kind = ResolvedKind::Internal;
+                r.DefinedOn = IndexOf(s);
+                r.Mask = s->GetOwnInternalMask(t);
+                return r;
+            }
+        }
+        for (auto s = first; s != nullptr; s = s->GetSuperState()) {
+            if (s->IsOwnIgnored(t)) {
+                r.Kind = ResolvedKind::Ignored;
+                return r;
+            }
+        }
+        for (auto s = first; s != nullptr; s = s->GetSuperState()) {
+            if (s->IsOwnDeferred(t)) {
+                r.Kind = ResolvedKind::Deferred;
+                return r;
+            }
+        }
+        return r;
+    }
+
+    template<typename TState, typename TTrigger>
+    inline std::string CExporter<TState, TTrigger>::GuardHook(unsigned int state, unsigned int trigger, size_t decision) const
+    {
+        // numbered when a trigger has more than one target on the state
+        auto decisions = m_definition.GetState((TState)state).GetOwnDecisions((TTrigger)trigger);
+        std::string hook = Hook("guard", state, trigger);
+        return decisions.second - decisions.first > 1 ? hook + "_" + std::to_string(decision) : hook;
+    }
+
+    template<typename TState, typename TTrigger>
+    inline std::string CExporter<TState, TTrigger>::GuardCondition(const ResolvedDecision& decision) const
+    {
+        std::string condition;
+        if (!decision.Mask.IsEmpty()) {
+            condition = "(m->conditions & " + Hex(decision.Mask.Required | decision.Mask.Forbidden) + ") == " + Hex(decision.Mask.Required);
+        }
+        if (!decision.GuardHook.empty()) {
+            condition += (condition.empty() ? "" : " && ") + decision.GuardHook + "(m)";
+        }
+        return condition;
+    }
+
+    template<typename TState, typename TTrigger>
+    inline std::vector<unsigned int> CExporter<TState, TTrigger>::GetChain(unsigned int state) const
+    {
+        std::vector<unsigned int> chain;
+        for (auto s = &m_definition.GetState((TState)state); s != nullptr; s = s->GetSuperState()) {
+            chain.insert(chain.begin(), IndexOf(s));
+        }
+        return chain;
+    }
+
+    template<typename TState, typename TTrigger>
+    inline std::string CExporter<TState, TTrigger>::StateName(unsigned int state) const
+    {
+        if (state < m_options.StateNames.size()) {
+            return Sanitize(m_options.StateNames[state]);
+        }
+        return state == 0 ? "None" : "State" + std::to_string(state);
+    }
+
+    template<typename TState, typename TTrigger>
+    inline std::string CExporter<TState, TTrigger>::TriggerName(unsigned int trigger) const
+    {
+        if (trigger < m_options.TriggerNames.size()) {
+            return Sanitize(m_options.TriggerNames[trigger]);
+        }
+        return trigger == 0 ? "None" : "Trigger" + std::to_string(trigger);
+    }
+
+    template<typename TState, typename TTrigger>
+    inline std::string CExporter<TState, TTrigger>::Sanitize(const std::string& name)
+    {
+        std::string out;
+        for (char c : name) {
+            out += std::isalnum((unsigned char)c) ? c : '_';
+        }
+        return out;
+    }
+
+    template<typename TState, typename TTrigger>
+    inline std::string CExporter<TState, TTrigger>::Upper(std::string name)
+    {
+        for (auto& c : name) {
+            c = (char)std::toupper((unsigned char)c);
+        }
+        return name;
+    }
+
+    template<typename TState, typename TTrigger>
+    inline std::string CExporter<TState, TTrigger>::Hex(std::uint64_t value)
+    {
+        const char* digits = "0123456789abcdef";
+        std::string out;
+        do {
+            out.insert(out.begin(), digits[value % 16]);
+            value /= 16;
+        } while (value != 0);
+        return "UINT64_C(0x" + out + ")";
+    }
+
+    template<typename TState, typename TTrigger>
+    inline void CExporter<TState, TTrigger>::WriteDeclarations(std::ostream& out)
+    {
+        const unsigned int numStates = m_definition.GetNumStates();
+        const unsigned int numTriggers = m_definition.GetNumTriggers();
+        const std::string prefix = m_options.Prefix;
+        const std::string upper = Upper(prefix);
+
+        out << "typedef enum {\n";
+        for (unsigned int s = 0; s < numStates; s++) {
+            out << "    " << StateEnum(s) << " = " << s << ",\n";
+        }
+        out << "    " << upper << "_NUM_STATES = " << numStates << "\n} " << m_stateType << ";\n\n";
+
+        out << "typedef enum {\n";
+        for (unsigned int t = 0; t < numTriggers; t++) {
+            out << "    " << TriggerEnum(t) << " = " << t << ",\n";
+        }
+        out << "    " << upper << "_NUM_TRIGGERS = " << numTriggers << "\n} " << m_triggerType << ";\n\n";
+
+        out << "typedef enum {\n";
+        out << "    " << upper << "_FIRED,\n";
+        out << "    " << upper << "_GUARD_FAILED,\n";
+        out << "    " << upper << "_IGNORED,\n";
+        out << "    " << upper << "_DEFERRED, /* not permitted yet, the caller should hold it and fire it again after the next transition */\n";
+        out << "    " << upper << "_NOT_FOUND\n";
+        out << "} " << m_resultType << ";\n\n";
+
+        out << "typedef uint64_t " << prefix << "_conditions_t;\n\n";
+        out << "typedef struct {\n";
+        out << "    " << m_stateType << " state;\n";
+        out << "    " << prefix << "_conditions_t conditions; /* tested by PermitWhen guards */\n";
+        out << "} " << m_machineType << ";\n\n";
+
+        out << "void " << prefix << "_init(" << m_machineType << "* m, " << m_stateType << " initial);\n";
+        out << m_resultType << " " << prefix << "_fire(" << m_machineType << "* m, " << m_triggerType << " trigger);\n\n";
+
+        out << "/* hooks - implement these */\n";
+        for (unsigned int s = 1; s < numStates; s++) {
+            const StateRepresentation& state = m_definition.GetState((TState)s);
+            if (state.HasEnterHandler()) {
+                out << "void " << Hook("on_enter", s) << "(" << m_machineType << "* m, " << m_stateType << " from, " << m_stateType << " to);\n";
+            }
+            if (state.HasExitHandler()) {
+                out << "void " << Hook("on_exit", s) << "(" << m_machineType << "* m, " << m_stateType << " from, " << m_stateType << " to);\n";
+            }
+            for (unsigned int t = 1; t < numTriggers; t++) {
+                auto decisions = state.GetOwnDecisions((TTrigger)t);
+                for (auto d = decisions.first; d != decisions.second; d++) {
+                    if (d->GuardClause != nullptr) {
+                        out << "int " << GuardHook(s, t, d - decisions.first) << "(" << m_machineType << "* m);\n";
+                    }
+                }
+                if (state.HasOwnInternalTransition((TTrigger)t)) {
+                    out << "void " << Hook("internal", s, t) << "(" << m_machineType << "* m);\n";
+                }
+            }
+        }
+        out << "\n";
+    }
+
+    template<typename TState, typename TTrigger>
+    inline void CExporter<TState, TTrigger>::WriteTables(std::ostream& out)
+    {
+        const unsigned int numStates = m_definition.GetNumStates();
+        const unsigned int numTriggers = m_definition.GetNumTriggers();
+        const std::string prefix = m_options.Prefix;
+        const std::string upper = Upper(prefix);
+        const std::string index = numStates <= 256 ? "uint8_t" : "uint16_t";
+
+        size_t maxDepth = 1;
+        for (auto& chain : m_chains) {
+            maxDepth = std::max(maxDepth, chain.size());
+        }
+
+        out << "/* target of the first external transition for each state and trigger, super states resolved, 0 for none */\n";
+        out << "static const " << index << " " << prefix << "_targets[" << upper << "_NUM_STATES][" << upper << "_NUM_TRIGGERS] = {\n";
+        for (unsigned int s = 0; s < numStates; s++) {
+            out << "    { ";
+            for (unsigned int t = 0; t < numTriggers; t++) {
+                const ResolvedTrigger& r = s == 0 || t == 0 ? ResolvedTrigger() : m_resolved[s][t];
+                out << (r.Kind == ResolvedKind::External ? r.Decisions[0].Target : 0) << (t + 1 < numTriggers ? ", " : " ");
+            }
+            out << "}, /* " << StateName(s) << " */\n";
+        }
+        out << "};\n\n";
+
+        out << "/* each states super states, outermost first and ending with the state itself */\n";
+        out << "static const uint8_t " << prefix << "_depths[" << upper << "_NUM_STATES] = { ";
+        for (unsigned int s = 0; s < numStates; s++) {
+            out << m_chains[s].size() << (s + 1 < numStates ? ", " : " ");
+        }
+        out << "};\n";
+        out << "static const " << index << " " << prefix << "_chains[" << upper << "_NUM_STATES][" << maxDepth << "] = {\n";
+        for (unsigned int s = 0; s < numStates; s++) {
+            out << "    { ";
+            for (size_t i = 0; i < maxDepth; i++) {
+                out << (i < m_chains[s].size() ? m_chains[s][i] : 0) << (i + 1 < maxDepth ? ", " : " ");
+            }
+            out << "},\n";
+        }
+        out << "};\n\n";
+    }
+
+    template<typename TState, typename TTrigger>
+    inline void CExporter<TState, TTrigger>::WriteDispatcher(std::ostream& out)
+    {
+        const unsigned int numStates = m_definition.GetNumStates();
+        const unsigned int numTriggers = m_definition.GetNumTriggers();
+        const std::string prefix = m_options.Prefix;
+        const std::string upper = Upper(prefix);
+
+        // entry and exit hooks
+        const char* kinds[] = { "enter", "exit" };
+        for (const char* kind : kinds) {
+            const bool enter = std::string(kind) == "enter";
+            out << "static void " << prefix << "_" << kind << "(" << m_machineType << "* m, unsigned int state, " << m_stateType << " from, " << m_stateType << " to)\n{\n";
+            out << "    (void)m; (void)from; (void)to;\n";
+            out << "    switch (state) {\n";
+            for (unsigned int s = 1; s < numStates; s++) {
+                const StateRepresentation& state = m_definition.GetState((TState)s);
+                if (enter ? state.HasEnterHandler() : state.HasExitHandler()) {
+                    out << "    case " << StateEnum(s) << ": " << Hook(enter ? "on_enter" : "on_exit", s) << "(m, from, to); break;\n";
+                }
+            }
+            out << "    default: break;\n    }\n}\n\n";
+        }
+
+        out << "static void " << prefix << "_transition(" << m_machineType << "* m, " << m_stateType << " to)\n{\n";
+        out << "    const " << m_stateType << " from = m->state;\n";
+        out << "    unsigned int common = 0;\n";
+        out << "    int i;\n";
+        out << "    /* exit up to the closest common super state then enter down to the target */\n";
+        out << "    while (common < " << prefix << "_depths[from] && common < " << prefix << "_depths[to] && " << prefix << "_chains[from][common] == " << prefix << "_chains[to][common]) {\n";
+        out << "        common++;\n    }\n";
+        out << "    for (i = (int)" << prefix << "_depths[from] - 1; i >= (int)common; i--) {\n";
+        out << "        " << prefix << "_exit(m, " << prefix << "_chains[from][i], from, to);\n    }\n";
+        out << "    for (i = (int)common; i < (int)" << prefix << "_depths[to]; i++) {\n";
+        out << "        " << prefix << "_enter(m, " << prefix << "_chains[to][i], from, to);\n    }\n";
+        out << "    m->state = to;\n}\n\n";
+
+        out << "void " << prefix << "_init(" << m_machineType << "* m, " << m_stateType << " initial)\n{\n";
+        out << "    m->state = initial;\n    m->conditions = 0;\n}\n\n";
+
+        out << m_resultType << " " << prefix << "_fire(" << m_machineType << "* m, " << m_triggerType << " trigger)\n{\n";
+        out << "    unsigned int target;\n";
+        out << "    if ((unsigned int)trigger >= " << upper << "_NUM_TRIGGERS) {\n        return " << upper << "_NOT_FOUND;\n    }\n";
+        out << "    target = " << prefix << "_targets[m->state][trigger];\n";
+        out << "    /* guarded targets, internal transitions and ignored or deferred triggers */\n";
+        out << "    switch (m->state) {\n";
+        for (unsigned int s = 1; s < numStates; s++) {
+            std::string cases;
+            for (unsigned int t = 1; t < numTriggers; t++) {
+                const ResolvedTrigger& r = m_resolved[s][t];
+                std::string body;
+                switch (r.Kind) {
+                case ResolvedKind::External: {
+                    if (r.Decisions.size() == 1 && GuardCondition(r.Decisions[0]).empty()) {
+                        break; // the table has it
+                    }
+                    // the decision list, in the order the targets were configured
+                    bool fallback = false;
+                    for (auto& decision : r.Decisions) {
+                        std::string condition = GuardCondition(decision);
+                        if (condition.empty()) {
+                            body += "            target = " + std::to_string(decision.Target) + ";\n            break;\n";
+                            fallback = true;
+                            break;
+                        }
+                        body += "            if (" + condition + ") {\n";
+                        body += "                target = " + std::to_string(decision.Target) + ";\n                break;\n            }\n";
+                    }
+                    if (!fallback) {
+                        body += "            return " + upper + "_GUARD_FAILED;\n";
+                    }
+                    break;
+                }
+                case ResolvedKind::Internal:
+                    if (!r.Mask.IsEmpty()) {
+                        body += "            if ((m->conditions & " + Hex(r.Mask.Required | r.Mask.Forbidden) + ") != " + Hex(r.Mask.Required) + ") {\n";
+                        body += "                return " + upper + "_GUARD_FAILED;\n            }\n";
+                    }
+                    body += "            " + Hook("internal", r.DefinedOn, t) + "(m);\n";
+                    body += "            return " + upper + "_FIRED;\n";
+                    break;
+                case ResolvedKind::Ignored:
+                    body += "            return " + upper + "_IGNORED;\n";
+                    break;
+                case ResolvedKind::Deferred:
+                    body += "            return " + upper + "_DEFERRED;\n";
+                    break;
+                default:
+                    break;
+                }
+                if (!body.empty()) {
+                    cases += "        case " + TriggerEnum(t) + ":\n" + body;
+                }
+            }
+            if (!cases.empty()) {
+                out << "    case " << StateEnum(s) << ":\n";
+                out << "        switch (trigger) {\n" << cases << "        default: break;\n        }\n        break;\n";
+            }
+        }
+        out << "    default: break;\n    }\n";
+        out << "    if (target == 0) {\n        return " << upper << "_NOT_FOUND;\n    }\n";
+        out << "    " << prefix << "_transition(m, (" << m_stateType << ")target);\n";
+        out << "    return " << upper << "_FIRED;\n}\n\n";
+    }
+
+#pragma endregion
+
+} // end of namespace PS
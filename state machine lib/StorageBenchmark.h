@@ -0,0 +1,83 @@
+#pragma once
+#include "PacificState.h"
+#include <chrono>
+#include <random>
+#include <iostream>
+#include <iomanip>
+
+/*
+    Times trigger lookups on dense and sparse state storage as the number of triggers a state
+    configures grows, to show where the two cross over and what PSStorageMode::Auto picks.
+*/
+
+namespace StorageBenchmark {
+
+    enum class BenchState : unsigned int { None = 0, Configured = 1, Target = 2 };
+    enum class BenchTrigger : unsigned int { None = 0 };
+    using BenchMachine = PS::StateMachine<BenchState, BenchTrigger>;
+
+    struct Result {
+        double NsPerLookup;
+        size_t IndexBytes;
+        PS::PSStorageMode Storage;
+    };
+
+    inline Result Measure(const std::vector<unsigned int>& configured, const std::vector<unsigned int>& lookups, int numTriggers, PS::PSStorageMode mode)
+    {
+        BenchMachine::MachineDefinition definition(3, numTriggers);
+        auto config = definition.ConfigState(BenchState::Configured);
+        for (auto t : configured) {
+            config.Permit((BenchTrigger)t, BenchState::Target);
+        }
+        definition.SetStorageMode(mode);
+        definition.EnsureCompiled();
+        const auto& state = definition.GetState(BenchState::Configured);
+
+        size_t found = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (auto t : lookups) {
+            found += state.FindBehaviour((BenchTrigger)t) != nullptr;
+        }
+        auto end = std::chrono::steady_clock::now();
+        if (found == 0 && !lookups.empty()) {
+            std::cout << "no configured triggers were found" << std::endl;
+        }
+        double ns = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+        return Result{ ns / lookups.size(), state.GetIndexSize(), state.GetStorage() };
+    }
+
+    inline void Run(int numTriggers = 2048, size_t numLookups = 4000000)
+    {
+        std::mt19937 rng(42);
+        std::cout << "trigger lookups on a state with " << numTriggers << " triggers, half of them hits" << std::endl;
+        std::cout << std::setw(10) << "configured" << std::setw(10) << "fill %"
+                  << std::setw(14) << "dense ns" << std::setw(14) << "dense bytes"
+                  << std::setw(14) << "sparse ns" << std::setw(14) << "sparse bytes"
+                  << std::setw(10) << "auto" << std::endl;
+
+        for (int numConfigured = 1; numConfigured < numTriggers; numConfigured *= 2) {
+            // pick distinct triggers, zero is "None"
+            std::vector<unsigned int> all(numTriggers - 1);
+            for (int i = 0; i < numTriggers - 1; i++) {
+                all[i] = i + 1;
+            }
+            std::shuffle(all.begin(), all.end(), rng);
+            std::vector<unsigned int> configured(all.begin(), all.begin() + numConfigured);
+
+            std::vector<unsigned int> lookups(numLookups);
+            for (auto& t : lookups) {
+                t = (rng() & 1) ? configured[rng() % configured.size()] : 1 + rng() % (numTriggers - 1);
+            }
+
+            Result dense = Measure(configured, lookups, numTriggers, PS::PSStorageMode::Dense);
+            Result sparse = Measure(configured, lookups, numTriggers, PS::PSStorageMode::Sparse);
+            Result automatic = Measure(configured, {}, numTriggers, PS::PSStorageMode::Auto);
+            std::cout << std::fixed << std::setprecision(2)
+                      << std::setw(10) << numConfigured << std::setw(10) << 100.0 * numConfigured / numTriggers
+                      << std::setw(14) << dense.NsPerLookup << std::setw(14) << dense.IndexBytes
+                      << std::setw(14) << sparse.NsPerLookup << std::setw(14) << sparse.IndexBytes
+                      << std::setw(10) << (automatic.Storage == PS::PSStorageMode::Dense ? "dense" : "sparse") << std::endl;
+        }
+    }
+
+} // end of namespace StorageBenchmark
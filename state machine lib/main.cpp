@@ -1,6 +1,9 @@
 #include "PacificState.h"
+#include "PacificStateExport.h"
+#include "StorageBenchmark.h"
 #include <iostream>
 #include <thread>
+#include <fstream>
 #define THREAD_SLEEP_MS(ms) std::this_thread::sleep_for(std::chrono::duration<double,std::milli>(ms));
 
 #define TYPE3
@@ -30,6 +33,11 @@ enum class Triggers : unsigned int {
 	ToggleMute = 9
 };
 
+// bits of the state machines condition word
+namespace Conditions {
+	constexpr PS::StateMachine<States, Triggers>::ConditionWord Muted = 1 << 0;
+}
+
 std::string statenames[] = { "None", "Loading", "Intro","MainMenu", "Playing","PausedMenu","EditingLevel", "NonPlaying","LoadingProgress", "SavingProgress"};
 std::string triggerNames[] = { "None", "Skip", "Finish","Play" , "Edit", "Pause", "QuitToMainMenu","Load","Save","ToggleMute"};
 
@@ -38,9 +46,12 @@ void PrintPossibleTriggers(std::vector<Triggers>& allowedTriggers);
 void AwaitEventHandling(const PS::StateMachine<States,Triggers>& sm);
 
 int main(int argc, char* argv[]) { 
-	static bool muted = false;
 	std::cout << "fojdsiofjdsoi world" << std::endl;
-	PS::StateMachine<States, Triggers> stateMachine(9,10, States::LoadingInitial);
+	PS::StateMachine<States, Triggers> stateMachine(10,10, States::LoadingInitial);
+	// finishing a level goes to the credits once every level is done, otherwise it saves first if autosave is on
+	const int numLevels = 3;
+	int levelsCompleted = 0;
+	bool autosave = true;
 	std::cout << "entering loading" << std::endl;
 	stateMachine.ConfigState(States::LoadingInitial)
 		.OnEntry([](PS::StateMachine< States, Triggers>::TransitionInfo t) {
@@ -81,6 +92,26 @@ int main(int argc, char* argv[]) {
 			})
 		.Permit(Triggers::Pause, States::PausedMenu)
 		.Permit(Triggers::Edit, States::EditingLevel)
+		.Permit(Triggers::QuitToMainMenu, States::MainMenu)
+		// tried in this order, the unguarded Permit last is the fallback
+		.PermitIf(Triggers::Finish, States::Intro, [&levelsCompleted, numLevels]() {
+				return levelsCompleted >= numLevels; // roll the intro again as the credits
+			})
+		.PermitIf(Triggers::Finish, States::SavingProgress, [&autosave]() {
+				return autosave;
+			})
+		.Permit(Triggers::Finish, States::MainMenu);
+
+	stateMachine.ConfigState(States::SavingProgress)
+		.SubStateOf(States::NonPlaying)
+		.OnEntry([&levelsCompleted](PS::StateMachine<States, Triggers>::TransitionInfo t) {
+				levelsCompleted++;
+				std::cout << "saving progress, " << levelsCompleted << " levels completed" << std::endl;
+			})
+		.OnExit([](PS::StateMachine<States, Triggers>::TransitionInfo t) {
+				std::cout << "exiting saving progress" << std::endl;
+			})
+		.Permit(Triggers::Play, States::Playing)
 		.Permit(Triggers::QuitToMainMenu, States::MainMenu);
 
 	stateMachine.ConfigState(States::PausedMenu)
@@ -92,21 +123,15 @@ int main(int argc, char* argv[]) {
 				std::cout << "exiting paused menu" << std::endl;
 			})
 		.Permit(Triggers::Play, States::Playing)
-		.PermitIf(Triggers::QuitToMainMenu, States::MainMenu, []() {
-				if (!muted) {
-					std::cout << "You're audio is not muted and so you can't quit to the main menu - nice feature" << std::endl;
-				}
-				return muted;
-			})
-		.InternalTransition(Triggers::ToggleMute, [](PS::StateMachine< States, Triggers>::TransitionInfo info) {
-				
-				if (muted) {
-					muted = false;
-				}
-				else{
-					muted = true;
-				}
+		.PermitWhen(Triggers::QuitToMainMenu, States::MainMenu, Conditions::Muted) // can only quit to the main menu when muted - nice feature
+		.InternalTransition(Triggers::ToggleMute, [&stateMachine](PS::StateMachine< States, Triggers>::TransitionInfo info) {
+				stateMachine.ToggleConditions(Conditions::Muted);
+				bool muted = stateMachine.GetConditions() & Conditions::Muted;
 				std::cout << (muted ? "muted" : "unmuted") << std::endl;
+			})
+		.InternalTransition(Triggers::Save, [&autosave](PS::StateMachine< States, Triggers>::TransitionInfo info) {
+				autosave = !autosave;
+				std::cout << "autosave " << (autosave ? "on" : "off") << std::endl;
 			});
 
 	stateMachine.ConfigState(States::EditingLevel)
@@ -198,6 +223,27 @@ int main(int argc, char* argv[]) {
 		}
 	}
 #endif
+#ifdef TYPE4
+	/*
+		export the configuration above as a plain C dispatcher for an embedded target,
+		hooks are declared for the handlers and guards that can't be exported
+	*/
+	PS::PSExportOptions options;
+	options.Prefix = "game";
+	options.StateNames.assign(std::begin(statenames), std::end(statenames));
+	options.TriggerNames.assign(std::begin(triggerNames), std::end(triggerNames));
+	std::ofstream file("game_dispatch.h");
+	PS::ExportC(stateMachine, file, options);
+	std::cout << "exported to game_dispatch.h" << std::endl;
+	return 0;
+#endif
+#ifdef TYPE5
+	/*
+		compare dense and sparse trigger storage, build in release for meaningful numbers
+	*/
+	StorageBenchmark::Run();
+	return 0;
+#endif
 
 
 	THREAD_SLEEP_MS(3000);